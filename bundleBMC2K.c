@@ -0,0 +1,132 @@
+/*
+Compile the calibration directory ($bmc_calib) into a binary bundle that
+runBMC2K can mmap at startup instead of parsing the text config and
+reading the FITS files. Rerun this whenever the calibration changes;
+runBMC2K ignores a bundle that is older than its source files.
+
+To compile:
+gcc -O3 -o build/bundleBMC2K bundleBMC2K.c calibBMC2K.c -lcfitsio -lm
+
+To run:
+./bundleBMC2K [number of actuators]
+*/
+
+/* System Headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "calibBMC2K.h"
+
+static uint64_t align_up(uint64_t offset)
+{
+    return (offset + BMC2K_BUNDLE_ALIGN - 1) & ~(uint64_t)(BMC2K_BUNDLE_ALIGN - 1);
+}
+
+int writeBundle(uint32_t act_count)
+{
+    bmc2k_calib calib;
+    bmc2k_bundle_header * hdr;
+    bmc2k_source_stat sources[BMC2K_NSRC];
+    uint8_t * buffer;
+    uint64_t size, gather_offset;
+    char path[1000];
+    char tmppath[1010];
+    int32_t * gather;
+    uint32_t idx;
+    FILE * fp;
+
+    /* Record the source files before reading them so that an edit made
+    while we're compiling leaves the bundle stale rather than silently
+    out of date. */
+    calib_stat_sources(sources);
+
+    if (calib_load_files(&calib, act_count))
+        return -1;
+
+    // lay out header and gather table on aligned boundaries
+    size = align_up(sizeof(bmc2k_bundle_header));
+    gather_offset = size;
+    size = align_up(size + act_count * sizeof(int32_t));
+
+    buffer = (uint8_t *) calloc(1, size);
+    if (buffer == NULL)
+    {
+        printf("Memory allocation error\n");
+        calib_release(&calib);
+        return -1;
+    }
+
+    hdr = (bmc2k_bundle_header *) buffer;
+    hdr->magic = BMC2K_BUNDLE_MAGIC;
+    hdr->version = BMC2K_BUNDLE_VERSION;
+    hdr->header_size = sizeof(bmc2k_bundle_header);
+    hdr->file_size = size;
+    hdr->shm_dim = calib.shm_dim;
+    hdr->act_count = act_count;
+    hdr->act_gain = calib.act_gain;
+    hdr->volume_factor = calib.volume_factor;
+    hdr->command_scale = calib.command_scale;
+    hdr->gather_offset = gather_offset;
+    memcpy(hdr->sources, sources, sizeof(sources));
+
+    gather = (int32_t *)(buffer + gather_offset);
+    for (idx = 0; idx < act_count; idx++)
+    {
+        gather[idx] = calib.actuator_mapping[idx];
+    }
+    hdr->checksum = calib_checksum(buffer, size);
+
+    // write to a temporary file and rename so runBMC2K never sees a partial bundle
+    calib_path(BMC2K_CALIB_BUNDLE, path, sizeof(path));
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    fp = fopen(tmppath, "wb");
+    if (fp == NULL)
+    {
+        printf("Could not open %s for writing!\n", tmppath);
+        free(buffer);
+        calib_release(&calib);
+        return -1;
+    }
+    if (fwrite(buffer, 1, size, fp) != size || fclose(fp) != 0)
+    {
+        printf("Error writing %s!\n", tmppath);
+        unlink(tmppath);
+        free(buffer);
+        calib_release(&calib);
+        return -1;
+    }
+    if (rename(tmppath, path))
+    {
+        perror("rename");
+        free(buffer);
+        calib_release(&calib);
+        return -1;
+    }
+
+    printf("Wrote %s: %dx%d, %d actuators, act_gain %f, volume_factor %f\n", path,
+           calib.shm_dim, calib.shm_dim, act_count, calib.act_gain, calib.volume_factor);
+
+    free(buffer);
+    calib_release(&calib);
+    return 0;
+}
+
+/* Main program */
+int main( int argc, char ** argv )
+{
+    uint32_t act_count = BMC2K_DEFAULT_ACTCOUNT;
+
+    if (argc > 1)
+    {
+        act_count = strtoul(argv[1], NULL, 10);
+        if (act_count == 0)
+        {
+            printf("Usage: %s [number of actuators]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    return writeBundle(act_count) ? 1 : 0;
+}
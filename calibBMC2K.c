@@ -0,0 +1,348 @@
+/*
+Calibration loading for the BMC 2K, shared by runBMC2K and bundleBMC2K.
+See calibBMC2K.h for the file layout.
+*/
+
+#include "calibBMC2K.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* FITS */
+#include "fitsio.h"
+
+static const char * source_names[BMC2K_NSRC] = {
+    BMC2K_CALIB_CONFIG,
+    BMC2K_CALIB_MAPPING
+};
+
+int calib_path(const char * name, char * path, size_t len)
+{
+    char * bmc_calib;
+
+    // find calibration file location from bmc_calib env variable
+    bmc_calib = getenv("bmc_calib");
+    if (bmc_calib == NULL)
+    {
+        printf("'bmc_calib' environment variable not set!\n");
+        return -1;
+    }
+    snprintf(path, len, "%s/%s", bmc_calib, name);
+    return 0;
+}
+
+/* Read in a configuration file with user-calibrated
+values to determine the conversion from physical to
+fractional stroke as well as the volume displaced by
+the influence function. */
+int calib_parse_config(const char * path, uint32_t *shm_dim, float *act_gain, float *volume_factor)
+{
+    FILE * fp;
+    char * line = NULL;
+    size_t len = 0;
+    float calibvals[3];
+    int idx = 0;
+
+    // open file
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        printf("Could not read configuration file at %s!\n", path);
+        return -1;
+    }
+
+    // grab first value from each line, ignoring anything past the third
+    while (idx < 3 && getline(&line, &len, fp) != -1)
+    {
+        calibvals[idx] = strtod(line, NULL);
+        idx++;
+    }
+    free(line);
+    fclose(fp);
+
+    if (idx < 3)
+    {
+        printf("Configuration file %s has %d values, expected 3!\n", path, idx);
+        return -1;
+    }
+
+    // assign dimension, stroke and volume factors
+    (*shm_dim) = calibvals[0];
+    (*act_gain) = calibvals[1];
+    (*volume_factor) = calibvals[2];
+    return 0;
+}
+
+int calib_read_fits_int(const char * path, int **pix, long naxes[2])
+{
+    fitsfile *fptr;  /* FITS file pointer */
+    int status = 0;  /* CFITSIO status value MUST be initialized to zero! */
+    int hdutype, naxis;
+    long fpixel[2] = {1, 1};
+
+    *pix = NULL;
+    if (fits_open_image(&fptr, path, READONLY, &status))
+    {
+        fits_report_error(stderr, status);
+        return -1;
+    }
+
+    if (fits_get_hdu_type(fptr, &hdutype, &status) || hdutype != IMAGE_HDU) {
+        printf("Error: this program only works on images, not tables\n");
+        fits_close_file(fptr, &status);
+        return -1;
+    }
+
+    fits_get_img_dim(fptr, &naxis, &status);
+    fits_get_img_size(fptr, 2, naxes, &status);
+    if (status || naxis != 2) {
+        printf("Error: NAXIS = %d.  Only 2-D images are supported.\n", naxis);
+        fits_close_file(fptr, &status);
+        return -1;
+    }
+
+    *pix = (int *) malloc(naxes[0] * naxes[1] * sizeof(int));
+    if (*pix == NULL) {
+        printf("Memory allocation error\n");
+        fits_close_file(fptr, &status);
+        return -1;
+    }
+
+    // read the whole image at once rather than row by row
+    fits_read_pix(fptr, TINT, fpixel, naxes[0] * naxes[1], 0, *pix, 0, &status);
+    fits_close_file(fptr, &status);
+
+    if (status) {
+        fits_report_error(stderr, status); /* print any error message */
+        free(*pix);
+        *pix = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void calib_stat_sources(bmc2k_source_stat sources[BMC2K_NSRC])
+{
+    char path[1000];
+    struct stat st;
+    int idx;
+
+    memset(sources, 0, BMC2K_NSRC * sizeof(bmc2k_source_stat));
+    for (idx = 0; idx < BMC2K_NSRC; idx++)
+    {
+        if (calib_path(source_names[idx], path, sizeof(path)) || stat(path, &st))
+            continue;
+        sources[idx].present = 1;
+        sources[idx].size = st.st_size;
+        sources[idx].mtime_sec = st.st_mtim.tv_sec;
+        sources[idx].mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t len)
+{
+    const uint8_t * p = (const uint8_t *) data;
+    size_t idx;
+
+    for (idx = 0; idx < len; idx++)
+    {
+        hash ^= p[idx];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t calib_checksum(const void * bundle, size_t len)
+{
+    bmc2k_bundle_header hdr;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    // the header carries the calibration values, so it is covered too
+    memcpy(&hdr, bundle, sizeof(hdr));
+    hdr.checksum = 0;
+    hash = fnv1a(hash, &hdr, sizeof(hdr));
+    return fnv1a(hash, (const uint8_t *)bundle + sizeof(hdr), len - sizeof(hdr));
+}
+
+int calib_load_bundle(bmc2k_calib * calib)
+{
+    char path[1000];
+    bmc2k_source_stat sources[BMC2K_NSRC];
+    const bmc2k_bundle_header * hdr;
+    const int32_t * gather;
+    uint64_t npix;
+    uint32_t idx;
+    struct stat st;
+    void * addr;
+    int fd;
+
+    if (calib_path(BMC2K_CALIB_BUNDLE, path, sizeof(path)))
+        return -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(bmc2k_bundle_header))
+    {
+        close(fd);
+        printf("Calibration bundle %s is truncated.\n", path);
+        return -1;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    hdr = (const bmc2k_bundle_header *) addr;
+
+    // format checks
+    if (hdr->magic != BMC2K_BUNDLE_MAGIC || hdr->version != BMC2K_BUNDLE_VERSION
+        || hdr->header_size != sizeof(bmc2k_bundle_header) || hdr->file_size != (uint64_t)st.st_size
+        || hdr->gather_offset % BMC2K_BUNDLE_ALIGN
+        || hdr->gather_offset + hdr->act_count * sizeof(int32_t) > hdr->file_size)
+    {
+        printf("Calibration bundle %s has an unsupported format, ignoring it.\n", path);
+        munmap(addr, st.st_size);
+        return -1;
+    }
+    if (calib_checksum(addr, hdr->file_size) != hdr->checksum)
+    {
+        printf("Calibration bundle %s failed its checksum, ignoring it.\n", path);
+        munmap(addr, st.st_size);
+        return -1;
+    }
+
+    // sendCommand indexes the input image with these unchecked
+    npix = (uint64_t)hdr->shm_dim * hdr->shm_dim;
+    gather = (const int32_t *)((const uint8_t *)addr + hdr->gather_offset);
+    for (idx = 0; idx < hdr->act_count; idx++)
+    {
+        if (gather[idx] < -1 || gather[idx] >= (int64_t)npix)
+        {
+            printf("Calibration bundle %s maps actuator %d outside the %dx%d image, ignoring it.\n", path, idx + 1, hdr->shm_dim, hdr->shm_dim);
+            munmap(addr, st.st_size);
+            return -1;
+        }
+    }
+
+    // staleness check against the source files
+    calib_stat_sources(sources);
+    if (memcmp(sources, hdr->sources, sizeof(sources)) != 0)
+    {
+        printf("Calibration bundle %s is older than the calibration files, ignoring it.\n", path);
+        munmap(addr, st.st_size);
+        return 1;
+    }
+
+    calib->shm_dim = hdr->shm_dim;
+    calib->act_count = hdr->act_count;
+    calib->act_gain = hdr->act_gain;
+    calib->volume_factor = hdr->volume_factor;
+    calib->command_scale = hdr->command_scale;
+    calib->actuator_mapping = (int *)((uint8_t *)addr + hdr->gather_offset);
+    calib->from_bundle = 1;
+    calib->map_addr = addr;
+    calib->map_len = st.st_size;
+    return 0;
+}
+
+int calib_load_files(bmc2k_calib * calib, uint32_t act_count)
+{
+    char path[1000];
+    int *pix;
+    long naxes[2];
+    long ij;
+    int ignored = 0;
+
+    memset(calib, 0, sizeof(bmc2k_calib));
+
+    if (calib_path(BMC2K_CALIB_CONFIG, path, sizeof(path)))
+        return -1;
+    if (calib_parse_config(path, &calib->shm_dim, &calib->act_gain, &calib->volume_factor))
+        return -1;
+    calib->command_scale = calib->volume_factor / calib->act_gain;
+
+    /* actuator mapping from 2D cacao image to 1D vector of commands,
+    initialized to -1 to allow for handling addressable but ignored actuators */
+    calib->act_count = act_count;
+    calib->actuator_mapping = (int *) malloc(act_count * sizeof(int));
+    if (calib->actuator_mapping == NULL) {
+        printf("Memory allocation error\n");
+        return -1;
+    }
+    for (ij = 0; ij < act_count; ij++) {
+        calib->actuator_mapping[ij] = -1;
+    }
+
+    if (calib_path(BMC2K_CALIB_MAPPING, path, sizeof(path)) || calib_read_fits_int(path, &pix, naxes))
+    {
+        calib_release(calib);
+        return -1;
+    }
+    if (naxes[0] != calib->shm_dim || naxes[1] != calib->shm_dim)
+    {
+        printf("Actuator mapping is %ldx%ld, expected %dx%d\n", naxes[0], naxes[1], calib->shm_dim, calib->shm_dim);
+        free(pix);
+        calib_release(calib);
+        return -1;
+    }
+    for (ij = 0; ij < naxes[0] * naxes[1]; ij++) {
+        if (pix[ij] > 0 && pix[ij] <= (int)act_count) {
+            // ij-th pixel maps to actuator pix[ij]
+            calib->actuator_mapping[pix[ij] - 1] = ij;
+        }
+        else if (pix[ij] > (int)act_count) {
+            ignored++;
+        }
+    }
+    free(pix);
+    if (ignored) {
+        printf("Ignoring %d actuators in mapping beyond the first %d\n", ignored, act_count);
+    }
+    return 0;
+}
+
+int calib_load(const char * serial, bmc2k_calib * calib, uint32_t act_count)
+{
+    char path[1000];
+    int rv;
+
+    memset(calib, 0, sizeof(bmc2k_calib));
+    rv = calib_load_bundle(calib);
+    if (rv == 0)
+    {
+        calib_path(BMC2K_CALIB_BUNDLE, path, sizeof(path));
+    }
+    else
+    {
+        if (calib_load_files(calib, act_count))
+            return -1;
+        calib_path(BMC2K_CALIB_CONFIG, path, sizeof(path));
+    }
+
+    printf("BMC %s: Using dimensions, stroke, volume calibration and actuator mapping from %s\n", serial, path);
+    printf("BMC %s: dim: %dx%d\n", serial, calib->shm_dim, calib->shm_dim);
+    printf("BMC %s: act_gain: %f\n", serial, calib->act_gain);
+    printf("BMC %s: volume_factor: %f\n", serial, calib->volume_factor);
+    return 0;
+}
+
+void calib_release(bmc2k_calib * calib)
+{
+    if (calib->from_bundle)
+    {
+        munmap(calib->map_addr, calib->map_len);
+    }
+    else
+    {
+        free(calib->actuator_mapping);
+    }
+    memset(calib, 0, sizeof(bmc2k_calib));
+}
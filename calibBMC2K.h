@@ -0,0 +1,127 @@
+/*
+Calibration loading for the BMC 2K.
+
+Calibration lives in the directory pointed to by the bmc_calib environment
+variable:
+
+    bmc_2k_userconfig.txt         dimension, actuator gain, volume factor
+    bmc_2k_actuator_mapping.fits  2D image of actuator numbers (1-indexed)
+
+Parsing the text file and reading the FITS image through cfitsio is slow
+enough to dominate startup, so bundleBMC2K compiles the directory into a
+single binary bundle (bmc_2k_calib.bundle) that runBMC2K can mmap directly.
+The bundle records the size and modification time of every source file it
+was built from; if any of them changed, or the bundle covers fewer
+actuators than the DM has, it is considered stale and the loader falls
+back to reading the text and FITS files.
+*/
+
+#ifndef CALIBBMC2K_H
+#define CALIBBMC2K_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BMC2K_CALIB_CONFIG   "bmc_2k_userconfig.txt"
+#define BMC2K_CALIB_MAPPING  "bmc_2k_actuator_mapping.fits"
+#define BMC2K_CALIB_BUNDLE   "bmc_2k_calib.bundle"
+
+#define BMC2K_BUNDLE_MAGIC   0x4b324342444e4c42ULL /* "BLNDBC2K" */
+#define BMC2K_BUNDLE_VERSION 3
+#define BMC2K_BUNDLE_ALIGN   64
+
+/* Default number of actuators on the BMC 2K */
+#define BMC2K_DEFAULT_ACTCOUNT 2040
+
+// Source files tracked by the bundle for staleness checks
+enum
+{
+    BMC2K_SRC_CONFIG = 0,
+    BMC2K_SRC_MAPPING,
+    BMC2K_NSRC
+};
+
+/* Size and modification time of a calibration source file.
+A missing file is recorded with present = 0. */
+typedef struct
+{
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t present;
+    uint32_t pad;
+} bmc2k_source_stat;
+
+/* On-disk bundle header. All table offsets are relative to the start
+of the file and aligned to BMC2K_BUNDLE_ALIGN bytes. The checksum covers
+the whole file, header included, with the checksum field itself zeroed. */
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t file_size;
+    uint64_t checksum;          // FNV-1a over the file with this field zeroed
+
+    uint32_t shm_dim;           // shared memory image is shm_dim x shm_dim
+    uint32_t act_count;         // length of the gather table
+    float act_gain;             // microns/fractional voltage^2
+    float volume_factor;        // volume conversion factor
+    float command_scale;        // volume_factor / act_gain, microns to fractional voltage^2
+    uint32_t pad;
+
+    uint64_t gather_offset;     // int32_t[act_count]: image pixel for each actuator, -1 if unused
+
+    bmc2k_source_stat sources[BMC2K_NSRC];
+} bmc2k_bundle_header;
+
+/* Calibration as used by the control loop. When loaded from a bundle,
+the tables point into the read-only mapping and must not be freed
+individually; use calib_release(). */
+typedef struct
+{
+    uint32_t shm_dim;
+    uint32_t act_count;
+    float act_gain;
+    float volume_factor;
+    float command_scale;        // volume_factor / act_gain
+    int * actuator_mapping;     // act_count entries
+
+    // bookkeeping
+    int from_bundle;
+    void * map_addr;
+    size_t map_len;
+} bmc2k_calib;
+
+/* Build "$bmc_calib/<name>" into path. Returns -1 if bmc_calib is unset. */
+int calib_path(const char * name, char * path, size_t len);
+
+/* Read the text config (dimension, gain, volume factor). */
+int calib_parse_config(const char * path, uint32_t *shm_dim, float *act_gain, float *volume_factor);
+
+/* Read a 2D integer FITS image in a single call. On success *pix is
+malloc'd and holds naxes[0]*naxes[1] values. */
+int calib_read_fits_int(const char * path, int **pix, long naxes[2]);
+
+/* Record the size/mtime of each calibration source file. */
+void calib_stat_sources(bmc2k_source_stat sources[BMC2K_NSRC]);
+
+/* FNV-1a checksum of a bundle of len bytes, taken with its checksum
+field treated as zero */
+uint64_t calib_checksum(const void * bundle, size_t len);
+
+/* Map the bundle and validate it against the source files. Returns 0 on
+success, 1 if the bundle is missing or stale, -1 on a corrupt bundle. */
+int calib_load_bundle(bmc2k_calib * calib);
+
+/* Load calibration from the text config and FITS files. The gather table
+holds act_count entries; actuator numbers beyond that are ignored. */
+int calib_load_files(bmc2k_calib * calib, uint32_t act_count);
+
+/* Load from the bundle, falling back to the text and FITS files if the
+bundle is missing, stale or corrupt. act_count is only used by the fallback. */
+int calib_load(const char * serial, bmc2k_calib * calib, uint32_t act_count);
+
+void calib_release(bmc2k_calib * calib);
+
+#endif
@@ -0,0 +1,471 @@
+/*
+Flight recorder for the BMC 2K control loop. See recorderBMC2K.h.
+*/
+
+#include "recorderBMC2K.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* FITS */
+#include "fitsio.h"
+
+static uint64_t align_up(uint64_t offset)
+{
+    return (offset + BMC2K_RECORDER_ALIGN - 1) & ~(uint64_t)(BMC2K_RECORDER_ALIGN - 1);
+}
+
+/* Copy the input image into a slot, bypassing the cache.
+dst is always 64-byte aligned. */
+static void stream_floats(float * dst, const float * src, size_t n)
+{
+    size_t idx = 0;
+#ifdef __SSE2__
+    for (; idx + 4 <= n; idx += 4)
+        _mm_stream_ps(dst + idx, _mm_loadu_ps(src + idx));
+#endif
+    for (; idx < n; idx++)
+        dst[idx] = src[idx];
+}
+
+/* Convert the command vector to single precision (ample for a 14-bit DAC)
+and copy it into a slot, bypassing the cache. */
+static void stream_doubles_to_floats(float * dst, const double * src, size_t n)
+{
+    size_t idx = 0;
+#ifdef __SSE2__
+    for (; idx + 4 <= n; idx += 4)
+    {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + idx));
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + idx + 2));
+        _mm_stream_ps(dst + idx, _mm_movelh_ps(lo, hi));
+    }
+#endif
+    for (; idx < n; idx++)
+        dst[idx] = (float)src[idx];
+}
+
+/* Copy of the ring taken for a dump, oldest frame first */
+typedef struct
+{
+    bmc2k_recorder_header hdr;
+    uint8_t * slots;            // nframes * hdr.slot_size bytes
+    uint64_t first;             // index of the oldest frame
+    uint64_t nframes;
+} recorder_snapshot;
+
+static int map_ring(bmc2k_recorder * rec, int fd, size_t len, int prot)
+{
+    void * addr = mmap(NULL, len, prot, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    rec->hdr = (bmc2k_recorder_header *) addr;
+    rec->slots = (uint8_t *) addr + rec->hdr->slots_offset;
+    rec->map_len = len;
+    return 0;
+}
+
+/* Check that a header (possibly left over from a crash) describes a
+ring of exactly len bytes whose slots hold what they claim to. */
+static int valid_header(const bmc2k_recorder_header * hdr, uint64_t len)
+{
+    uint64_t npix = (uint64_t)hdr->shm_dim * hdr->shm_dim;
+
+    if (hdr->magic != BMC2K_RECORDER_MAGIC || hdr->version != BMC2K_RECORDER_VERSION
+        || hdr->header_size != sizeof(bmc2k_recorder_header))
+        return 0;
+    if (hdr->nslots == 0 || hdr->slot_size == 0 || hdr->slot_size % BMC2K_RECORDER_ALIGN
+        || hdr->slots_offset < sizeof(bmc2k_recorder_header) || hdr->slots_offset % BMC2K_RECORDER_ALIGN
+        || hdr->slots_offset > len || (len - hdr->slots_offset) / hdr->slot_size != hdr->nslots
+        || (len - hdr->slots_offset) % hdr->slot_size)
+        return 0;
+    // sizes are bounded by slot_size before multiplying to avoid overflow
+    if (npix > hdr->slot_size || hdr->act_count > hdr->slot_size
+        || hdr->input_offset % BMC2K_RECORDER_ALIGN || hdr->command_offset % BMC2K_RECORDER_ALIGN
+        || hdr->input_offset < sizeof(bmc2k_recorder_frame)
+        || hdr->input_offset + npix * sizeof(float) > hdr->command_offset
+        || hdr->command_offset + (uint64_t)hdr->act_count * sizeof(float) > hdr->slot_size)
+        return 0;
+    return 1;
+}
+
+/* Copy the recorded frames out of the ring. If live, the control loop may
+keep writing while this runs: a frame is only kept if the writer hadn't
+started overwriting its slot by the time the copy finished. Slots are
+reused in order, so the frames lost this way are the oldest ones. */
+static int take_snapshot(bmc2k_recorder * rec, recorder_snapshot * snap, int live)
+{
+    uint64_t nwritten, frame, idx, skip;
+    uint8_t * dst;
+
+    memcpy(&snap->hdr, rec->hdr, sizeof(bmc2k_recorder_header));
+    nwritten = __atomic_load_n(&rec->hdr->nwritten, __ATOMIC_ACQUIRE);
+    snap->nframes = nwritten < snap->hdr.nslots ? nwritten : snap->hdr.nslots;
+    snap->first = nwritten - snap->nframes;
+    snap->slots = NULL;
+    if (snap->nframes == 0)
+        return 0;
+
+    snap->slots = (uint8_t *) malloc(snap->nframes * snap->hdr.slot_size);
+    if (snap->slots == NULL)
+    {
+        printf("Flight recorder: memory allocation error\n");
+        return -1;
+    }
+
+    skip = 0;
+    for (idx = 0; idx < snap->nframes; idx++)
+    {
+        frame = snap->first + idx;
+        dst = snap->slots + idx * snap->hdr.slot_size;
+        memcpy(dst, rec->slots + (frame % snap->hdr.nslots) * (uint64_t)snap->hdr.slot_size, snap->hdr.slot_size);
+        // the slot is rewritten while the writer works on frame + nslots
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (live && frame + snap->hdr.nslots <= __atomic_load_n(&rec->hdr->nwritten, __ATOMIC_ACQUIRE))
+            skip = idx + 1;
+    }
+
+    if (skip)
+    {
+        memmove(snap->slots, snap->slots + skip * snap->hdr.slot_size, (snap->nframes - skip) * snap->hdr.slot_size);
+        snap->first += skip;
+        snap->nframes -= skip;
+    }
+    return 0;
+}
+
+static int write_snapshot(const recorder_snapshot * snap, const char * name, const char * dump_dir, const char * reason)
+{
+    const bmc2k_recorder_header * hdr = &snap->hdr;
+    const bmc2k_recorder_frame * frame;
+    const uint8_t * slot;
+    fitsfile *fptr;  /* FITS file pointer */
+    int status = 0;  /* CFITSIO status value MUST be initialized to zero! */
+    char fitspath[1600];
+    char timestr[32];
+    struct timespec now;
+    char * ttype[] = {"TIME_SEC", "TIME_NSEC", "CNT0", "RV"};
+    char * tform[] = {"1K", "1K", "1K", "1J"};
+    char * tunit[] = {"s", "ns", "", ""};
+    long naxes[3];
+    long long cnt0;
+    uint64_t idx, npix;
+
+    npix = (uint64_t)hdr->shm_dim * hdr->shm_dim;
+
+    /* Millisecond time plus the index of the newest frame keeps names
+    unique; cfitsio refuses to overwrite an existing file, so an earlier
+    dump is never replaced. */
+    clock_gettime(CLOCK_REALTIME, &now);
+    strftime(timestr, sizeof(timestr), "%Y%m%dT%H%M%S", gmtime(&now.tv_sec));
+    snprintf(fitspath, sizeof(fitspath), "%s/bmc2k_%s_%s.%03ld_%lu_%s.fits", dump_dir, name, timestr,
+             now.tv_nsec / 1000000, (unsigned long)(snap->first + snap->nframes), reason);
+
+    fits_create_file(&fptr, fitspath, &status);
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        return -1;
+    }
+
+    // primary HDU: input images
+    naxes[0] = hdr->shm_dim;
+    naxes[1] = hdr->shm_dim;
+    naxes[2] = snap->nframes;
+    fits_create_img(fptr, FLOAT_IMG, 3, naxes, &status);
+    fits_write_key(fptr, TSTRING, "REASON", (void *)reason, "why the flight recorder was dumped", &status);
+    fits_write_key(fptr, TSTRING, "SHMNAME", (void *)name, "shared memory image", &status);
+    for (idx = 0; idx < snap->nframes && !status; idx++)
+    {
+        slot = snap->slots + idx * hdr->slot_size;
+        fits_write_img(fptr, TFLOAT, 1 + idx * npix, npix, (void *)(slot + hdr->input_offset), &status);
+    }
+
+    // commands sent to the DM
+    naxes[0] = hdr->act_count;
+    naxes[1] = snap->nframes;
+    fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+    fits_write_key(fptr, TSTRING, "EXTNAME", "COMMANDS", "", &status);
+    for (idx = 0; idx < snap->nframes && !status; idx++)
+    {
+        slot = snap->slots + idx * hdr->slot_size;
+        fits_write_img(fptr, TFLOAT, 1 + idx * hdr->act_count, hdr->act_count, (void *)(slot + hdr->command_offset), &status);
+    }
+
+    // per-frame timestamps, counters and return codes
+    fits_create_tbl(fptr, BINARY_TBL, snap->nframes, 4, ttype, tform, tunit, "FRAMES", &status);
+    for (idx = 0; idx < snap->nframes && !status; idx++)
+    {
+        frame = (const bmc2k_recorder_frame *)(snap->slots + idx * hdr->slot_size);
+        cnt0 = frame->cnt0;
+        fits_write_col(fptr, TLONGLONG, 1, idx + 1, 1, 1, (void *)&frame->tv_sec, &status);
+        fits_write_col(fptr, TLONGLONG, 2, idx + 1, 1, 1, (void *)&frame->tv_nsec, &status);
+        fits_write_col(fptr, TLONGLONG, 3, idx + 1, 1, 1, &cnt0, &status);
+        fits_write_col(fptr, TINT, 4, idx + 1, 1, 1, (void *)&frame->rv, &status);
+    }
+
+    fits_close_file(fptr, &status);
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        return -1;
+    }
+
+    printf("Flight recorder: wrote %lu frames to %s\n", (unsigned long)snap->nframes, fitspath);
+    return 0;
+}
+
+static int dump_frames(bmc2k_recorder * rec, const char * dump_dir, const char * reason, int live)
+{
+    recorder_snapshot snap;
+    int rv;
+
+    if (rec->hdr == NULL)
+        return 0;
+    if (take_snapshot(rec, &snap, live))
+        return -1;
+
+    rv = 0;
+    if (snap.nframes > 0)
+        rv = write_snapshot(&snap, rec->name, dump_dir, reason);
+    free(snap.slots);
+    return rv;
+}
+
+static void * dump_thread_main(void * ptr)
+{
+    bmc2k_recorder * rec = (bmc2k_recorder *) ptr;
+
+    dump_frames(rec, rec->dump_dir, rec->dump_reason, 1);
+    __atomic_store_n(&rec->dump_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void join_dump_thread(bmc2k_recorder * rec)
+{
+    if (rec->dump_active)
+    {
+        pthread_join(rec->dump_thread, NULL);
+        rec->dump_active = 0;
+    }
+}
+
+/* Dump whatever a previous (possibly crashed) run left in the ring file.
+If that fails, the file is renamed aside so recorder_open() doesn't
+truncate it. */
+static void recover_previous(bmc2k_recorder * rec, const char * dump_dir)
+{
+    bmc2k_recorder_header hdr;
+    struct stat st;
+    char aside[1100];
+    int fd, rv;
+
+    fd = open(rec->path, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(bmc2k_recorder_header)
+        || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    {
+        close(fd);
+        return;
+    }
+    if (!valid_header(&hdr, st.st_size))
+    {
+        printf("Flight recorder: ignoring unreadable ring file %s\n", rec->path);
+        close(fd);
+        return;
+    }
+    if (hdr.nwritten == 0 || map_ring(rec, fd, st.st_size, PROT_READ))
+    {
+        close(fd);
+        rec->hdr = NULL;
+        return;
+    }
+    close(fd);
+
+    printf("Recovering %lu frames from previous run in %s\n", (unsigned long)hdr.nwritten, rec->path);
+    rv = dump_frames(rec, dump_dir, "previous", 0);
+    munmap(rec->hdr, rec->map_len);
+    rec->hdr = NULL;
+
+    if (rv)
+    {
+        snprintf(aside, sizeof(aside), "%s.%ld", rec->path, (long)time(NULL));
+        if (rename(rec->path, aside) == 0)
+            printf("Flight recorder: could not recover frames; previous ring kept as %s\n", aside);
+        else
+            perror("rename");
+    }
+}
+
+int recorder_open(bmc2k_recorder * rec, const char * shm_name, uint32_t shm_dim, uint32_t act_count, uint32_t nslots, const char * dump_dir)
+{
+    bmc2k_recorder_header hdr;
+    size_t len;
+    int fd;
+
+    memset(rec, 0, sizeof(bmc2k_recorder));
+    snprintf(rec->name, sizeof(rec->name), "%s", shm_name);
+    snprintf(rec->path, sizeof(rec->path), "/dev/shm/bmc2k_%s_recorder", shm_name);
+
+    recover_previous(rec, dump_dir);
+
+    // lay out metadata, input image and command vector on aligned boundaries
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = BMC2K_RECORDER_MAGIC;
+    hdr.version = BMC2K_RECORDER_VERSION;
+    hdr.header_size = sizeof(bmc2k_recorder_header);
+    hdr.shm_dim = shm_dim;
+    hdr.act_count = act_count;
+    hdr.nslots = nslots;
+    hdr.input_offset = align_up(sizeof(bmc2k_recorder_frame));
+    hdr.command_offset = align_up(hdr.input_offset + (uint64_t)shm_dim * shm_dim * sizeof(float));
+    hdr.slot_size = align_up(hdr.command_offset + (uint64_t)act_count * sizeof(float));
+    hdr.slots_offset = align_up(sizeof(bmc2k_recorder_header));
+    len = hdr.slots_offset + (size_t)nslots * hdr.slot_size;
+
+    // recreate the file so every slot starts out zeroed
+    fd = open(rec->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Could not create flight recorder at %s!\n", rec->path);
+        return -1;
+    }
+    /* Allocate every page now: on tmpfs a sparse file would only fail
+    later, as SIGBUS inside recorder_write. */
+    if ((errno = posix_fallocate(fd, 0, len)) != 0)
+    {
+        printf("Could not allocate %.1f MB for flight recorder at %s (%s); recording disabled.\n",
+               len / 1048576., rec->path, strerror(errno));
+        close(fd);
+        unlink(rec->path);
+        return -1;
+    }
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || map_ring(rec, fd, len, PROT_READ | PROT_WRITE))
+    {
+        close(fd);
+        rec->hdr = NULL;
+        return -1;
+    }
+    close(fd);
+
+    printf("Flight recorder: %d frames (%.1f MB) at %s\n", nslots, len / 1048576., rec->path);
+    return 0;
+}
+
+void recorder_write(bmc2k_recorder * rec, const float * input, const double * command, uint64_t cnt0, int rv)
+{
+    bmc2k_recorder_header * hdr = rec->hdr;
+    bmc2k_recorder_frame frame;
+    struct timespec ts;
+    uint64_t nwritten;
+    uint8_t * slot;
+
+    if (hdr == NULL)
+        return;
+
+    nwritten = hdr->nwritten;
+    slot = rec->slots + (nwritten % hdr->nslots) * (uint64_t)hdr->slot_size;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    frame.tv_sec = ts.tv_sec;
+    frame.tv_nsec = ts.tv_nsec;
+    frame.cnt0 = cnt0;
+    frame.rv = rv;
+    frame.pad = 0;
+
+#ifdef __SSE2__
+    _mm_stream_si128((__m128i *)slot, _mm_loadu_si128((const __m128i *)&frame));
+    _mm_stream_si128((__m128i *)slot + 1, _mm_loadu_si128((const __m128i *)&frame + 1));
+#else
+    memcpy(slot, &frame, sizeof(frame));
+#endif
+    stream_floats((float *)(slot + hdr->input_offset), input, (size_t)hdr->shm_dim * hdr->shm_dim);
+    stream_doubles_to_floats((float *)(slot + hdr->command_offset), command, hdr->act_count);
+
+    // make the slot visible before publishing it
+#ifdef __SSE2__
+    _mm_sfence();
+#endif
+    __atomic_store_n(&hdr->nwritten, nwritten + 1, __ATOMIC_RELEASE);
+}
+
+int recorder_dump(bmc2k_recorder * rec, const char * dump_dir, const char * reason)
+{
+    join_dump_thread(rec);
+    return dump_frames(rec, dump_dir, reason, 0);
+}
+
+int recorder_dump_async(bmc2k_recorder * rec, const char * dump_dir, const char * reason)
+{
+    sigset_t block, old;
+    int rv;
+
+    if (rec->hdr == NULL)
+        return 0;
+    if (rec->dump_active)
+    {
+        if (!__atomic_load_n(&rec->dump_done, __ATOMIC_ACQUIRE))
+        {
+            printf("Flight recorder: a dump is already in progress\n");
+            return -1;
+        }
+        join_dump_thread(rec);
+    }
+
+    snprintf(rec->dump_dir, sizeof(rec->dump_dir), "%s", dump_dir);
+    snprintf(rec->dump_reason, sizeof(rec->dump_reason), "%s", reason);
+    rec->dump_done = 0;
+
+    /* The thread inherits our signal mask: block SIGINT and SIGUSR1 while
+    creating it so they are only ever delivered to the control loop, whose
+    wait they need to interrupt. */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    rv = pthread_create(&rec->dump_thread, NULL, dump_thread_main, rec);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rv)
+    {
+        printf("Flight recorder: could not start dump thread\n");
+        return -1;
+    }
+    rec->dump_active = 1;
+    return 0;
+}
+
+int recorder_finish(bmc2k_recorder * rec, const char * dump_dir, const char * reason)
+{
+    int rv;
+
+    if (rec->hdr == NULL)
+        return 0;
+
+    rv = recorder_dump(rec, dump_dir, reason);
+    munmap(rec->hdr, rec->map_len);
+    rec->hdr = NULL;
+    if (rv)
+    {
+        printf("Flight recorder: dump failed; frames kept in %s and will be recovered on the next start\n", rec->path);
+        return rv;
+    }
+    unlink(rec->path);
+    return 0;
+}
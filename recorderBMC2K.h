@@ -0,0 +1,104 @@
+/*
+Flight recorder for the BMC 2K control loop.
+
+A ring buffer in a memory-mapped file under /dev/shm holds the last
+nslots frames sent to the DM: the shared memory input image, the command
+vector actually handed to BMCSetArray, a timestamp, the input frame
+counter and the BMCSetArray return code. Slots are written with
+non-temporal stores so recording doesn't evict the loop's working set
+from cache.
+
+The ring is written out to FITS by recorder_dump(), or from a background
+thread by recorder_dump_async() so the control loop keeps running (runBMC2K
+does the former on error and SIGINT, the latter on SIGUSR1). Dumps copy
+the ring first and drop any frame the loop overwrote during the copy.
+Because it lives in a file, the ring also survives a crash; recorder_open()
+dumps any frames left over by a previous run before reusing the file (or
+renames it to <path>.<time> if that dump fails), and recorder_finish()
+keeps the file if its dump failed.
+
+The FITS file has three HDUs:
+
+    primary   float   shm_dim x shm_dim x nframes   input images
+    COMMANDS  float   act_count x nframes           commands (fractional volts)
+    FRAMES    table   TIME_SEC, TIME_NSEC, CNT0, RV
+*/
+
+#ifndef RECORDERBMC2K_H
+#define RECORDERBMC2K_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define BMC2K_RECORDER_MAGIC   0x5243455232434d42ULL /* "BMC2RECR" */
+#define BMC2K_RECORDER_VERSION 1
+#define BMC2K_RECORDER_ALIGN   64
+
+/* Header at the start of the ring file */
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t shm_dim;
+    uint32_t act_count;
+    uint32_t nslots;
+    uint32_t slot_size;         // bytes per slot, multiple of BMC2K_RECORDER_ALIGN
+    uint64_t slots_offset;      // offset of slot 0 from the start of the file
+    uint64_t input_offset;      // offset of the input image within a slot
+    uint64_t command_offset;    // offset of the command vector within a slot
+    uint64_t nwritten;          // total frames recorded; slot = nwritten % nslots
+} bmc2k_recorder_header;
+
+/* Per-frame metadata at the start of each slot */
+typedef struct
+{
+    int64_t tv_sec;
+    int64_t tv_nsec;
+    uint64_t cnt0;              // shared memory image counter
+    int32_t rv;                 // BMCSetArray return code
+    uint32_t pad;
+} bmc2k_recorder_frame;
+
+typedef struct
+{
+    bmc2k_recorder_header * hdr;
+    uint8_t * slots;
+    size_t map_len;
+    char path[1000];
+    char name[256];
+
+    // background dump requested by recorder_dump_async()
+    pthread_t dump_thread;
+    int dump_active;            // dump_thread has been started and not joined
+    volatile int dump_done;     // dump_thread has finished
+    char dump_dir[1000];
+    char dump_reason[32];
+} bmc2k_recorder;
+
+/* Create (or reuse) the ring file for the shared memory image shm_name,
+large enough for nslots frames. Frames left over from a previous run are
+dumped to FITS in dump_dir first. Returns -1, leaving recording disabled,
+if the ring can't be created or its memory allocated. */
+int recorder_open(bmc2k_recorder * rec, const char * shm_name, uint32_t shm_dim, uint32_t act_count, uint32_t nslots, const char * dump_dir);
+
+/* Record one frame. Called from the control loop after every command
+with the input that command was computed from. */
+void recorder_write(bmc2k_recorder * rec, const float * input, const double * command, uint64_t cnt0, int rv);
+
+/* Write the recorded frames, oldest first, to
+<dump_dir>/bmc2k_<shm_name>_<time>_<last frame>_<reason>.fits. Waits for any
+background dump first; the loop must not be recording meanwhile. Returns
+0 on success or if nothing was recorded. */
+int recorder_dump(bmc2k_recorder * rec, const char * dump_dir, const char * reason);
+
+/* Start recorder_dump() on a background thread and return immediately.
+Returns -1 if a previous background dump is still running. */
+int recorder_dump_async(bmc2k_recorder * rec, const char * dump_dir, const char * reason);
+
+/* Dump, then unmap the ring. The ring file is removed only if the dump
+succeeded; otherwise it is left for recovery on the next start. */
+int recorder_finish(bmc2k_recorder * rec, const char * dump_dir, const char * reason);
+
+#endif
@@ -1,9 +1,9 @@
 /*
 To compile:
-gcc -o build/runBMC2K runBMC2K.c -I/opt/Boston\ Micromachines/include -L/opt/Boston\ Micromachines/lib -Wl,-rpath-link,/opt/Boston\ Micromachines/lib -lBMC -lBMC_PCIeAPI -lncurses -lImageStreamIO -lpthread -lrt -lm -lcfitsio
+gcc -o build/runBMC2K runBMC2K.c calibBMC2K.c recorderBMC2K.c -I/opt/Boston\ Micromachines/include -L/opt/Boston\ Micromachines/lib -Wl,-rpath-link,/opt/Boston\ Micromachines/lib -lBMC -lBMC_PCIeAPI -lncurses -lImageStreamIO -lpthread -lrt -lm -lcfitsio
 
 To run:
-./runBMC2K <serial> <shared_memory_name> --bias <bias_value> --linear --fractional
+./runBMC2K <serial> <shared_memory_name> --bias <bias_value> --linear --fractional --record <seconds> --rate <Hz> --dump-dir <dir>
 */
 
 /* BMC */
@@ -21,14 +21,20 @@ To run:
 #include <unistd.h>
 #include <math.h>
 #include <argp.h>
+#include <pthread.h>
 
-/* FITS */
-#include "fitsio.h"
+/* calibration bundle and FITS fallback */
+#include "calibBMC2K.h"
+
+/* flight recorder */
+#include "recorderBMC2K.h"
 
 typedef int bool_t;
 
 // interrupt signal handling for safe DM shutdown
 volatile sig_atomic_t stop;
+// SIGUSR1 requests a flight recorder dump
+volatile sig_atomic_t dump_requested;
 
 void handle_signal(int signal)
 {
@@ -37,6 +43,10 @@ void handle_signal(int signal)
         printf("\nExiting the BMC 2K control loop.\n");
         stop = 1;
     }
+    else if (signal == SIGUSR1)
+    {
+        dump_requested = 1;
+    }
 }
 
 // Initialize the shared memory image
@@ -99,145 +109,10 @@ double clip_to_limits(double command)
     return command;
 }
 
-/* Read in a configuration file with user-calibrated
-values to determine the conversion from physical to
-fractional stroke as well as the volume displaced by
-the influence function. */
-int parse_calibration_file(const char * serial, uint32_t *shm_dim, float *act_gain, float *volume_factor)
-{
-    char * bmc_calib;
-    char calibpath[1000];
-    char serial_lc[1000];
-    FILE * fp;
-    char * line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    char * token;
-    float * calibvals;
-
-    // find calibration file location from bmc_calib env variable
-    bmc_calib = getenv("bmc_calib");
-    if (bmc_calib == NULL)
-    {
-        printf("'bmc_calib' environment variable not set!\n");
-        return -1;
-    }
-    strcpy(calibpath, bmc_calib);
-    strcat(calibpath,  "/bmc_2k_userconfig.txt");
-
-    // open file
-    fp = fopen(calibpath, "r");
-    if (fp == NULL)
-    {
-        printf("Could not read configuration file at %s!\n", calibpath);
-        return -1;
-    }
-
-    calibvals = (float*) malloc(2*sizeof(float));
-    int idx = 0;
-    while ((read = getline(&line, &len, fp)) != -1)
-    {
-        // grab first value from each line
-        calibvals[idx] = strtod(line, NULL);
-        idx++;
-    }
-
-    fclose(fp);
-
-    // assign stroke and volume factors
-    (*shm_dim) = calibvals[0];
-    (*act_gain) = calibvals[1];
-    (*volume_factor) = calibvals[2];
-
-    printf("BMC %s: Using dimensions, stroke, and volume calibration from %s\n", serial, calibpath);
-    printf("BMC %s: dim: %dx%d\n", serial, *shm_dim, *shm_dim);
-    printf("BMC %s: act_gain: %f\n", serial, *act_gain);
-    printf("BMC %s: volume_factor: %f\n", serial, *volume_factor);
-    return 0;
-}
-
-int get_actuator_mapping(const char * serial_number, int nbAct, int * actuator_mapping)
-{
-    /* This function closely follows the CFITSIO imstat
-    example */
-
-    fitsfile *fptr;  /* FITS file pointer */
-    int status = 0;  /* CFITSIO status value MUST be initialized to zero! */
-    int hdutype, naxis, ii;
-    long naxes[2], totpix, fpixel[2];
-    int *pix;
-    int ij = 0; /* actuator mapping index */
-
-    char * bmc_calib;
-    char calibname[1000];
-    char calibpath[1000];
-
-    // get file path to actuator map
-    bmc_calib = getenv("bmc_calib");
-    strcpy(calibpath, bmc_calib);
-    sprintf(calibname, "/bmc_2k_actuator_mapping.fits");
-    strcat(calibpath, calibname);
-
-    if ( !fits_open_image(&fptr, calibpath, READONLY, &status) )
-    {
-      if (fits_get_hdu_type(fptr, &hdutype, &status) || hdutype != IMAGE_HDU) { 
-        printf("Error: this program only works on images, not tables\n");
-        return(1);
-      }
-
-      fits_get_img_dim(fptr, &naxis, &status);
-      fits_get_img_size(fptr, 2, naxes, &status);
-
-      if (status || naxis != 2) { 
-        printf("Error: NAXIS = %d.  Only 2-D images are supported.\n", naxis);
-        return(1);
-      }
-
-      pix = (int *) malloc(naxes[0] * sizeof(int)); /* memory for 1 row */
-
-      if (pix == NULL) {
-        printf("Memory allocation error\n");
-        return(1);
-      }
-
-      totpix = naxes[0] * naxes[1];
-      fpixel[0] = 1;  /* read starting with first pixel in each row */
-
-      /* process image one row at a time; increment row # in each loop */
-      for (fpixel[1] = 1; fpixel[1] <= naxes[1]; fpixel[1]++)
-      {  
-         /* give starting pixel coordinate and number of pixels to read */
-         if (fits_read_pix(fptr, TINT, fpixel, naxes[0],0, pix,0, &status))
-            break;   /* jump out of loop on error */
-
-         
-         for (ii = 0; ii < naxes[0]; ii++) {
-           if (pix[ii] > 0) {
-                // get indices of active actuators in order
-                // ij-th pixels maps to actuator pix[ii]
-                actuator_mapping[pix[ii] - 1] = ij;//(fpixel[1]-1) * naxes[0] + ii;
-                //printf("Actuator %d at address %d\n", pix[ii] - 1, ij);
-           }
-           ij++;
-         }
-      }
-      fits_close_file(fptr, &status);
-    }
-
-    if (status)  {
-        fits_report_error(stderr, status); /* print any error message */
-    }
-
-    free(pix);
-
-    printf("BMC %s: Using actuator mapping from %s\n", serial_number, calibpath);
-    return 0;
-}
-
 struct timespec t0;
 struct timespec t1;
 struct timespec t2;
-BMCRC sendCommand(DM hdm, double *command, uint32_t *map_lut, IMAGE * SMimage, double bias, int linear, int fractional, float act_gain, float volume_factor, int * actuator_mapping, uint32_t ActCount) {
+BMCRC sendCommand(DM hdm, double *command, uint32_t *map_lut, const float * input, double bias, int linear, int fractional, float command_scale, int * actuator_mapping, uint32_t ActCount) {
    //clock_gettime(CLOCK_REALTIME, &t0);
 
 
@@ -259,7 +134,7 @@ BMCRC sendCommand(DM hdm, double *command, uint32_t *map_lut, IMAGE * SMimage, d
         else {
             /* addressable and active actuators have an integer
             address to their location in the command vector */
-            command[idx] = SMimage[0].array.F[address];
+            command[idx] = input[address];
         }
 
         /* If inputs are given in microns, convert from microns
@@ -277,7 +152,7 @@ BMCRC sendCommand(DM hdm, double *command, uint32_t *map_lut, IMAGE * SMimage, d
         This requires DM calibration.
          */
         if (fractional == 0) {
-            command[idx] *= volume_factor / act_gain;
+            command[idx] *= command_scale;
         }
 
         /* Keep track of the mean. Only used if we're explicitly
@@ -358,65 +233,125 @@ BMCRC sendCommand(DM hdm, double *command, uint32_t *map_lut, IMAGE * SMimage, d
 }
 
 
+/* Driver open runs on its own thread so that it overlaps with
+calibration loading and shared memory creation. */
+struct openDMArgs
+{
+    const char * serial_number;
+    DM * hdm;
+    uint32_t * map_lut;
+    BMCRC rv;
+};
+
+void * openDM(void * ptr)
+{
+    struct openDMArgs * args = (struct openDMArgs *) ptr;
+    int idx;
+
+    // Open driver
+    args->rv = BMCOpen(args->hdm, args->serial_number);
+    // Check for errors
+    if(args->rv) {
+        printf("Error %d opening the driver type %u.\n", args->rv, (unsigned int)args->hdm->Driver_Type);
+        return NULL;
+    }
+
+    printf("Opened Device %d with %d actuators.\n", args->hdm->DevId, (uint32_t)args->hdm->ActCount);
+
+    // Load actuator map (BMC SDK specific)
+    for(idx=0; idx<(int)args->hdm->ActCount; idx++) {
+        args->map_lut[idx] = 0;
+    }
+    BMCLoadMap(args->hdm, NULL, args->map_lut);
+    return NULL;
+}
+
 // intialize DM and shared memory and enter DM command loop
-int controlLoop(const char * serial_number, const char * shm_name, double bias, int linear, int fractional) {
+int controlLoop(const char * serial_number, const char * shm_name, double bias, int linear, int fractional, double record_seconds, double record_rate, const char * dump_dir) {
 
     // Initialize variables
     DM hdm = {};
     BMCRC rv;
-    int idx;
     uint32_t ActCount;
     uint32_t *map_lut;
     IMAGE * SMimage;
-    int *actuator_mapping; // 50x50 image to 1D vector of commands
-    uint32_t shm_dim = 50; // Hard-coded for now
+    int *actuator_mapping; // 2D image to 1D vector of commands
+    uint32_t shm_dim;
+    pthread_t open_thread;
+    struct openDMArgs open_args;
 
-    // command vector
+    // command vector and the input frame it is computed from
     double *command;
+    float *input = NULL;        // private copy of the input, only when recording
+    const float *frame_input;
+    uint64_t cnt0, last_cnt0;
 
-    float act_gain, volume_factor; // calibration
+    bmc2k_calib calib;
+    float command_scale; // calibration, volume_factor / act_gain
 
-    /* get actuator gain and volume normalization factor from
-    the user-defined config file */
-    rv = parse_calibration_file(serial_number, &shm_dim, &act_gain, &volume_factor);
-    if (rv == -1)
-    {
+    bmc2k_recorder recorder;
+    uint32_t record_frames;
+    int recording = 0;
+
+    if (!(record_seconds >= 0) || !(record_rate > 0) || record_seconds * record_rate > UINT32_MAX) {
+        printf("Invalid flight recorder size: %f s at %f Hz\n", record_seconds, record_rate);
         return -1;
     }
+    record_frames = record_seconds * record_rate;
 
-    // Open driver
-    rv = BMCOpen(&hdm, serial_number);
-    // Check for errors
-    if(rv) {
-        printf("Error %d opening the driver type %u.\n", rv, (unsigned int)hdm.Driver_Type);
-        printf("%s\n\n", BMCErrorString(rv));
-        return rv;
+    // Open the driver in the background
+    map_lut = (uint32_t *)malloc(sizeof(uint32_t)*MAX_DM_SIZE);
+    open_args.serial_number = serial_number;
+    open_args.hdm = &hdm;
+    open_args.map_lut = map_lut;
+    open_args.rv = 0;
+    if (pthread_create(&open_thread, NULL, openDM, &open_args)) {
+        printf("Could not start driver thread.\n");
+        return -1;
     }
-    ActCount = (uint32_t)hdm.ActCount;
 
-    printf("Opened Device %d with %d actuators.\n", hdm.DevId, ActCount);
+    /* Meanwhile, get the image dimensions, actuator gain, volume
+    normalization factor and mapping from 2D cacao image to 1D vector
+    of commands, from the precompiled bundle if it's up to date and
+    from the user-defined config and FITS files otherwise. The driver
+    isn't open yet, so size the fallback mapping for the largest DM. */
+    rv = calib_load(serial_number, &calib, MAX_DM_SIZE);
+    if (rv == 0) {
+        shm_dim = calib.shm_dim;
+        command_scale = calib.command_scale;
+        actuator_mapping = calib.actuator_mapping;
+
+        // initialize shared memory image to 0s
+        initializeSharedMemory(shm_name, shm_dim, shm_dim);
+        // connect to shared memory image (SMimage)
+        SMimage = (IMAGE*) malloc(sizeof(IMAGE));
+        ImageStreamIO_read_sharedmem_image_toIMAGE(shm_name, &SMimage[0]);
+    }
 
-    // Load actuator map (BMC SDK specific)
-    map_lut = (uint32_t *)malloc(sizeof(uint32_t)*MAX_DM_SIZE);
-    for(idx=0; idx<ActCount; idx++) {
-        map_lut[idx] = 0;
+    pthread_join(open_thread, NULL);
+    if (open_args.rv) {
+        printf("%s\n\n", BMCErrorString(open_args.rv));
+        return open_args.rv;
     }
-    rv = BMCLoadMap(&hdm, NULL, map_lut);
-
-    /* get actuator mapping from 2D cacao image to 1D vector for
-    ALPAO input */
-    actuator_mapping = (int *) malloc(ActCount * sizeof(int)); /* memory for actuator mapping */
-    /* initialize to -1 to allow for handling addressable but ignored actuators */
-    for (idx=0; idx<ActCount; idx++) {
-        actuator_mapping[idx] = -1;
+    if (rv) {
+        BMCClose(&hdm);
+        return -1;
     }
-    get_actuator_mapping(serial_number, ActCount, actuator_mapping);
+    ActCount = (uint32_t)hdm.ActCount;
 
-    // initialize shared memory image to 0s
-    initializeSharedMemory(shm_name, shm_dim, shm_dim);
-    // connect to shared memory image (SMimage)
-    SMimage = (IMAGE*) malloc(sizeof(IMAGE));
-    ImageStreamIO_read_sharedmem_image_toIMAGE(shm_name, &SMimage[0]);
+    /* A bundle built for fewer actuators than the DM has is stale;
+    fall back to the config and FITS files. */
+    if (ActCount > calib.act_count) {
+        printf("BMC %s: calibration bundle covers %d actuators but the DM has %d; reading the calibration files instead.\n", serial_number, calib.act_count, ActCount);
+        calib_release(&calib);
+        if (calib_load_files(&calib, ActCount) || calib.shm_dim != shm_dim) {
+            printf("BMC %s: could not load calibration files for %dx%d image.\n", serial_number, shm_dim, shm_dim);
+            BMCClose(&hdm);
+            return -1;
+        }
+        command_scale = calib.command_scale;
+        actuator_mapping = calib.actuator_mapping;
+    }
 
     // Validate SMimage dimensionality and size against DM
     if (SMimage[0].md[0].naxis != 2) {
@@ -435,22 +370,46 @@ int controlLoop(const char * serial_number, const char * shm_name, double bias,
     // initialize command vectors outside of the control loop
     command = (double*)calloc(ActCount, sizeof(double));
 
+    /* keep the last record_seconds of inputs and commands for post-mortem.
+    Recording is disabled if the ring can't be created. */
+    memset(&recorder, 0, sizeof(recorder));
+    if (record_frames > 0) {
+        recording = recorder_open(&recorder, shm_name, shm_dim, ActCount, record_frames, dump_dir) == 0;
+    }
+    if (recording) {
+        input = (float*)calloc(shm_dim * shm_dim, sizeof(float));
+    }
+
     // set DM to all-0 state to begin
     printf("BMC %s: initializing all actuators to 0.\n", serial_number);
     ImageStreamIO_semwait(&SMimage[0], 0);
-    rv  = sendCommand(hdm, command, map_lut, SMimage, bias, linear, fractional, act_gain, volume_factor, actuator_mapping, ActCount);
+    cnt0 = SMimage[0].md[0].cnt0;
+    frame_input = SMimage[0].array.F;
+    if (recording) {
+        memcpy(input, frame_input, shm_dim * shm_dim * sizeof(float));
+        frame_input = input;
+    }
+    rv  = sendCommand(hdm, command, map_lut, frame_input, bias, linear, fractional, command_scale, actuator_mapping, ActCount);
+    recorder_write(&recorder, frame_input, command, cnt0, rv);
+    last_cnt0 = cnt0;
     if (rv) {
         //printf("Error %d sending command.\n", rv);
         printf("%s\n\n", BMCErrorString(rv));
+        // leave the DM in a safe state before writing the recorder out
+        BMCClearArray(&hdm);
+        BMCClose(&hdm);
+        recorder_finish(&recorder, dump_dir, "error");
         return rv;
     }
 
-    // SIGINT handling
+    // SIGINT and SIGUSR1 handling
     struct sigaction action;
     action.sa_flags = SA_SIGINFO;
     action.sa_handler = handle_signal;
     sigaction(SIGINT, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
     stop = 0;
+    dump_requested = 0;
     double dt_loop = 0;
     double dt_com = 0;
     int times = 0;
@@ -459,13 +418,39 @@ int controlLoop(const char * serial_number, const char * shm_name, double bias,
         //printf("BMC %s: waiting on commands.\n", serial_number);
         // Wait on semaphore update
         ImageStreamIO_semwait(&SMimage[0], 0);
+
+        /* Dump on request from a background thread. If SIGUSR1
+        interrupted the wait there is no new frame, so go back to waiting;
+        if it arrived while we were busy, the frame still needs sending. */
+        if (dump_requested) {
+            dump_requested = 0;
+            recorder_dump_async(&recorder, dump_dir, "sigusr1");
+            if (SMimage[0].md[0].cnt0 == last_cnt0) {
+                continue;
+            }
+        }
         
         // Send Command to DM
         if (!stop) { // Skip DM on interrupt signal
-            rv = sendCommand(hdm, command, map_lut, SMimage, bias, linear, fractional, act_gain, volume_factor, actuator_mapping, ActCount);
+            /* latch the counter and, when recording, take a private copy
+            of the input so the recorded frame matches the command computed
+            from it */
+            cnt0 = SMimage[0].md[0].cnt0;
+            frame_input = SMimage[0].array.F;
+            if (recording) {
+                memcpy(input, frame_input, shm_dim * shm_dim * sizeof(float));
+                frame_input = input;
+            }
+            rv = sendCommand(hdm, command, map_lut, frame_input, bias, linear, fractional, command_scale, actuator_mapping, ActCount);
+            recorder_write(&recorder, frame_input, command, cnt0, rv);
+            last_cnt0 = cnt0;
             if (rv) {
                 printf("Error %d sending command.\n", rv);
                 printf("%s\n\n", BMCErrorString(rv));
+                // leave the DM in a safe state before writing the recorder out
+                BMCClearArray(&hdm);
+                BMCClose(&hdm);
+                recorder_finish(&recorder, dump_dir, "error");
                 return rv;
             }
 
@@ -485,12 +470,15 @@ int controlLoop(const char * serial_number, const char * shm_name, double bias,
     }
 
     free(command);
+    free(input);
+    calib_release(&calib);
 
     // Safe DM shutdown on loop interrupt
     // Zero all actuators
     rv = BMCClearArray(&hdm);
     if (rv) {
         printf("Error %d clearing voltages.\n", rv);
+        recorder_finish(&recorder, dump_dir, "error");
         return rv;
     }
     printf("BMC %s: all voltages set to 0.\n", serial_number);
@@ -498,9 +486,13 @@ int controlLoop(const char * serial_number, const char * shm_name, double bias,
     rv = BMCClose(&hdm);
     if (rv) {
         printf("Error %d closing the driver.\n", rv);
+        recorder_finish(&recorder, dump_dir, "error");
         return rv;
     }
     printf("BMC %s: connection closed.\n", serial_number);
+
+    // write the recorder out only once the DM is safe
+    recorder_finish(&recorder, dump_dir, "sigint");
     return 0;
 }
 
@@ -521,6 +513,9 @@ static struct argp_option options[] = {
   before the square root of inputs is taken (if enabled), so bias=0.5 -> 0.7 fractional volts." },
   {"linear",     'l', 0,      0,  "By default, the square root of inputs is sent to the DM. Toggling 'linear' disables this." },
   {"fractional", 'f', 0,      0,  "Disable multiplication by gain and volume factors. Toggling 'fractional' means commands are expected in the range [0,1]." },
+  {"record",     'r', "seconds", 0, "Keep the last 'seconds' of inputs and commands in a flight recorder, dumped to FITS on error, SIGINT or SIGUSR1. Default is 2; 0 disables recording." },
+  {"rate",       'R', "Hz",   0,  "Expected loop rate used to size the flight recorder. Default is 2000." },
+  {"dump-dir",   'd', "dir",  0,  "Directory for flight recorder FITS dumps. Default is the current directory." },
   { 0 }
 };
 
@@ -530,6 +525,8 @@ struct arguments
   char *args[2];                /* serial shm_name*/
   double bias;
   int linear, fractional;
+  double record_seconds, record_rate;
+  char *dump_dir;
 };
 
 /* Parse a single option. */
@@ -550,6 +547,15 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
     case 'f':
       arguments->fractional = 1;
       break;
+    case 'r':
+      arguments->record_seconds = atof(arg);
+      break;
+    case 'R':
+      arguments->record_rate = atof(arg);
+      break;
+    case 'd':
+      arguments->dump_dir = arg;
+      break;
     case ARGP_KEY_ARG:
       if (state->arg_num >= 2)
         /* Too many arguments. */
@@ -583,12 +589,16 @@ int main(int argc, char* argv[]) {
     arguments.bias = 0.0;
     arguments.linear = 0;
     arguments.fractional = 0;
+    arguments.record_seconds = 2.0;
+    arguments.record_rate = 2000.0;
+    arguments.dump_dir = ".";
 
     /* Parse our arguments; every option seen by parse_opt will
      be reflected in arguments. */
     argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
-    BMCRC rv = controlLoop(arguments.args[0], arguments.args[1], arguments.bias, arguments.linear, arguments.fractional);
+    BMCRC rv = controlLoop(arguments.args[0], arguments.args[1], arguments.bias, arguments.linear, arguments.fractional,
+                           arguments.record_seconds, arguments.record_rate, arguments.dump_dir);
     if (rv) {
         //printf("Encountered error %d.\n", rv);
         printf("%s\n\n", BMCErrorString(rv));